@@ -0,0 +1,376 @@
+#ifndef CLI_H
+#define CLI_H
+
+#include <stdbool.h>
+
+#include "text.h"
+
+// Headless subcommands, these edit the todo file without connecting to X
+// Operations that take indexes or text read them from stdin, one per line, if none are given
+
+// Lines deeper than depth following a matched line belong to its subtree and share its fate
+typedef struct
+{
+	bool active;
+	size_t depth;
+} cli_subtree_t;
+
+typedef struct
+{
+	size_t* indexes; // Sorted, 0 based
+	size_t count;
+	size_t next;
+	bool remove;
+	cli_subtree_t subtree;
+} cli_index_filter_t;
+
+typedef struct
+{
+	size_t removed;
+	cli_subtree_t subtree;
+} cli_purge_filter_t;
+
+// Returns true if line is part of the subtree started by the last matched line
+bool cli_in_subtree(cli_subtree_t* subtree, const char* line)
+{
+	if (subtree->active && text_depth(line) > subtree->depth)
+		return true;
+
+	subtree->active = false;
+	return false;
+}
+
+void cli_start_subtree(cli_subtree_t* subtree, const char* line)
+{
+	subtree->active = true;
+	subtree->depth = text_depth(line);
+}
+
+void cli_mark_done(char* line)
+{
+	if (text_is_item(line))
+		text_marker(line)[1] = 'X';
+}
+
+void cli_usage()
+{
+	fprintf(stderr, "Usage: slodo <FILE>\n");
+	fprintf(stderr, "       slodo add <FILE> [TEXT]...\n");
+	fprintf(stderr, "       slodo done <FILE> [INDEX]...\n");
+	fprintf(stderr, "       slodo rm <FILE> [INDEX]...\n");
+	fprintf(stderr, "       slodo purge <FILE>\n");
+	fprintf(stderr, "       slodo count <FILE>\n");
+	fprintf(stderr, "       slodo list <FILE>\n");
+}
+
+int cli_compare_index(const void* a, const void* b)
+{
+	size_t x = *(const size_t*) a;
+	size_t y = *(const size_t*) b;
+	return (x > y) - (x < y);
+}
+
+// Parses a 1 based index as printed by list
+int cli_parse_index(const char* str, size_t* index)
+{
+	char* end;
+	unsigned long long value = strtoull(str, &end, 10);
+	if (end == str || *end != '\0' || value == 0 || str[0] == '-')
+	{
+		fprintf(stderr, "ERROR: Invalid index (%s)\n", str);
+		return -1;
+	}
+
+	*index = value - 1;
+	return 0;
+}
+
+// Collects indexes from args, or from stdin if there are none
+int cli_read_indexes(int argc, char** argv, cli_index_filter_t* filter)
+{
+	size_t capacity = argc > 0 ? argc : 64;
+	filter->indexes = malloc(capacity * sizeof(size_t));
+	filter->count = 0;
+	filter->next = 0;
+	if (!filter->indexes)
+	{
+		fprintf(stderr, "ERROR: Failed to allocate memory for indexes\n");
+		return -1;
+	}
+
+	if (argc > 0)
+	{
+		for (int i = 0; i < argc; ++i)
+		{
+			if (cli_parse_index(argv[i], &filter->indexes[filter->count++]) == -1)
+				return -1;
+		}
+	}
+	else
+	{
+		char* line = NULL;
+		size_t len = 0;
+		ssize_t read;
+		while ((read = getline(&line, &len, stdin)) != -1)
+		{
+			line[strcspn(line, "\n")] = 0;
+			if (line[0] == '\0')
+				continue;
+
+			if (filter->count == capacity)
+			{
+				capacity *= 2;
+				filter->indexes = realloc(filter->indexes, capacity * sizeof(size_t));
+			}
+
+			if (cli_parse_index(line, &filter->indexes[filter->count++]) == -1)
+			{
+				free(line);
+				return -1;
+			}
+		}
+		free(line);
+	}
+
+	qsort(filter->indexes, filter->count, sizeof(size_t), cli_compare_index);
+	return 0;
+}
+
+int cli_index_filter(char* line, size_t index, void* data)
+{
+	cli_index_filter_t* filter = data;
+	if (line == NULL)
+	{
+		if (filter->next < filter->count)
+		{
+			fprintf(stderr, "ERROR: Index out of range (%zu)\n", filter->indexes[filter->next] + 1);
+			return -1;
+		}
+		return 0;
+	}
+
+	bool matched = false;
+
+	// Skip duplicate indexes, and indexes inside an already matched subtree
+	while (filter->next < filter->count && filter->indexes[filter->next] == index)
+	{
+		filter->next++;
+		matched = true;
+	}
+
+	if (!cli_in_subtree(&filter->subtree, line))
+	{
+		// done only applies to todo items, plain lines are kept as they are
+		if (!matched || (!filter->remove && !text_is_item(line)))
+			return 1;
+		cli_start_subtree(&filter->subtree, line);
+	}
+
+	if (filter->remove)
+		return 0;
+
+	cli_mark_done(line);
+	return 1;
+}
+
+int cli_purge_filter(char* line, size_t index, void* data)
+{
+	if (line == NULL)
+		return 0;
+
+	cli_purge_filter_t* filter = data;
+	if (cli_in_subtree(&filter->subtree, line))
+	{
+		filter->removed++;
+		return 0;
+	}
+
+	if (text_line_completed(line))
+	{
+		cli_start_subtree(&filter->subtree, line);
+		filter->removed++;
+		return 0;
+	}
+
+	return 1;
+}
+
+int cli_add(const char* path, int argc, char** argv)
+{
+	// Make sure appended lines don't end up on an unterminated last line
+	bool needs_newline = false;
+	FILE* fp = fopen(path, "r");
+	if (fp != NULL)
+	{
+		if (fseek(fp, -1, SEEK_END) == 0)
+			needs_newline = fgetc(fp) != '\n';
+		fclose(fp);
+	}
+
+	fp = fopen(path, "a");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "ERROR: Failed to open file (%s)\n", path);
+		return -1;
+	}
+
+	if (needs_newline)
+		fputc('\n', fp);
+
+	if (argc > 0)
+	{
+		fputs(EMPTY_TEXT, fp);
+		for (int i = 0; i < argc; ++i)
+		{
+			if (i != 0)
+				fputc(' ', fp);
+			fputs(argv[i], fp);
+		}
+		fputc('\n', fp);
+	}
+	else
+	{
+		char* line = NULL;
+		size_t len = 0;
+		ssize_t read;
+		while ((read = getline(&line, &len, stdin)) != -1)
+		{
+			line[strcspn(line, "\n")] = 0;
+			fputs(EMPTY_TEXT, fp);
+			fputs(line, fp);
+			fputc('\n', fp);
+		}
+		free(line);
+	}
+
+	if (fclose(fp) != 0)
+	{
+		fprintf(stderr, "ERROR: Failed to write file (%s)\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int cli_edit(const char* path, int argc, char** argv, bool remove)
+{
+	cli_index_filter_t filter;
+	filter.remove = remove;
+	filter.subtree.active = false;
+
+	int result = cli_read_indexes(argc, argv, &filter);
+	if (result == 0 && filter.count != 0)
+		result = text_stream_rewrite(path, cli_index_filter, &filter);
+
+	free(filter.indexes);
+	return result;
+}
+
+int cli_purge(const char* path)
+{
+	cli_purge_filter_t filter;
+	filter.removed = 0;
+	filter.subtree.active = false;
+	if (text_stream_rewrite(path, cli_purge_filter, &filter) == -1)
+		return -1;
+
+	printf("%zu\n", filter.removed);
+	return 0;
+}
+
+// Prints the number of open and completed todo items
+int cli_count(const char* path)
+{
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "ERROR: Failed to open file (%s)\n", path);
+		return -1;
+	}
+
+	size_t open = 0, done = 0;
+	char* line = NULL;
+	size_t len = 0;
+	while (getline(&line, &len, fp) != -1)
+	{
+		line[strcspn(line, "\n")] = 0;
+		if (!text_is_item(line))
+			continue;
+
+		if (text_line_completed(line))
+			done++;
+		else
+			open++;
+	}
+
+	free(line);
+	fclose(fp);
+
+	printf("%zu %zu\n", open, done);
+	return 0;
+}
+
+int cli_list(const char* path)
+{
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "ERROR: Failed to open file (%s)\n", path);
+		return -1;
+	}
+
+	char* line = NULL;
+	size_t len = 0;
+	size_t index = 0;
+	while (getline(&line, &len, fp) != -1)
+	{
+		line[strcspn(line, "\n")] = 0;
+		printf("%zu %s\n", ++index, line);
+	}
+
+	free(line);
+	fclose(fp);
+	return 0;
+}
+
+bool cli_is_command(const char* name)
+{
+	const char* commands[] = { "add", "done", "rm", "purge", "count", "list" };
+	for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i)
+	{
+		if (strcmp(name, commands[i]) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+// argv[1] is the command, argv[2] the todo file
+int cli_main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		cli_usage();
+		return -1;
+	}
+
+	const char* command = argv[1];
+	const char* path = argv[2];
+	if (strcmp(command, "add") == 0)
+		return cli_add(path, argc - 3, &argv[3]);
+	if (strcmp(command, "done") == 0)
+		return cli_edit(path, argc - 3, &argv[3], false);
+	if (strcmp(command, "rm") == 0)
+		return cli_edit(path, argc - 3, &argv[3], true);
+	if (strcmp(command, "purge") == 0)
+		return cli_purge(path);
+	if (strcmp(command, "count") == 0)
+		return cli_count(path);
+	if (strcmp(command, "list") == 0)
+		return cli_list(path);
+
+	cli_usage();
+	return -1;
+}
+
+#endif
@@ -0,0 +1,261 @@
+// LD_PRELOAD shim used by render-bench
+// Counts X requests, round trips and bytes written to the X socket for every wake-up of slodo's main loop
+// An operation starts when the first event of a wake-up is returned to slodo and ends when slodo
+// blocks in epoll_wait again, so the deferred render at the end of a wake-up belongs to it
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+
+#define SHIFT_KEY 50
+#define ESCAPE_KEY 9
+
+typedef struct
+{
+    const char* label;
+    double start;
+    double last_write;
+    unsigned int requests;
+    unsigned int round_trips;
+    size_t bytes;
+} bench_op_t;
+
+// Everything before the first epoll_wait is startup, including the first events
+static bench_op_t current = { "startup", 0, 0, 0, 0, 0 };
+static bool pending = true;
+static FILE* out = NULL;
+static int x_fd = -1;
+static bool shift = false;
+static bool insert = false;
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void *next_symbol(const char* name)
+{
+    void* symbol = dlsym(RTLD_NEXT, name);
+    if (!symbol)
+    {
+        fprintf(stderr, "ERROR: render-bench-shim can't find %s\n", name);
+        exit(-1);
+    }
+
+    return symbol;
+}
+
+static void finish_op()
+{
+    if (!out)
+    {
+        const char* path = getenv("RENDER_BENCH_OUT");
+        out = path ? fopen(path, "w") : stderr;
+        out = out ? out : stderr;
+    }
+
+    double latency = current.last_write > current.start ? current.last_write - current.start : 0;
+    fprintf(out, "%s %u %u %zu %.1f\n", current.label, current.requests, current.round_trips, current.bytes, latency);
+    fflush(out);
+}
+
+// Labels events the same way slodo interprets them
+static const char* label_event(xcb_generic_event_t* event)
+{
+    uint8_t type = event->response_type & ~0x80;
+    if (type == XCB_EXPOSE)
+        return "expose";
+
+    if (type == XCB_KEY_RELEASE)
+    {
+        if (((xcb_key_release_event_t*) event)->detail == SHIFT_KEY)
+            shift = false;
+        return "release";
+    }
+
+    if (type != XCB_KEY_PRESS)
+        return "other";
+
+    uint8_t detail = ((xcb_key_press_event_t*) event)->detail;
+    if (detail == SHIFT_KEY)
+    {
+        shift = true;
+        return "shift";
+    }
+    if (detail == ESCAPE_KEY)
+        return "quit";
+
+    if (insert)
+    {
+        if (detail == 36) // Enter
+        {
+            insert = false;
+            return "insert_enter";
+        }
+        return "insert_key";
+    }
+
+    switch (detail)
+    {
+        case 32: // O
+            insert = true;
+            return "open";
+        case 44: // J
+        case 45: // K
+            return shift ? "swap" : "navigate";
+        case 40: // D
+            return "toggle";
+    }
+
+    return "other";
+}
+
+// Modifier presses, releases and window manager events don't name an operation
+static bool is_significant(const char* label)
+{
+    return strcmp(label, "shift") != 0 && strcmp(label, "release") != 0 && strcmp(label, "other") != 0;
+}
+
+static xcb_generic_event_t* start_op(xcb_connection_t* c, xcb_generic_event_t* event)
+{
+    if (!event)
+        return event;
+
+    x_fd = xcb_get_file_descriptor(c);
+    const char* label = label_event(event);
+    if (!pending)
+    {
+        current.label = label;
+        current.start = now_us();
+        current.last_write = 0;
+        current.requests = 0;
+        current.round_trips = 0;
+        current.bytes = 0;
+        pending = true;
+    }
+    // The first key or expose names the operation, an Expose caused by its resize doesn't
+    else if (strcmp(current.label, "startup") != 0 && !is_significant(current.label))
+    {
+        current.label = label;
+    }
+
+    return event;
+}
+
+int epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout)
+{
+    static int (*real)(int, struct epoll_event*, int, int) = NULL;
+    real = real ? real : next_symbol("epoll_wait");
+    if (pending)
+    {
+        finish_op();
+        pending = false;
+    }
+    return real(epfd, events, maxevents, timeout);
+}
+
+xcb_generic_event_t* xcb_wait_for_event(xcb_connection_t* c)
+{
+    static xcb_generic_event_t* (*real)(xcb_connection_t*) = NULL;
+    real = real ? real : next_symbol("xcb_wait_for_event");
+    return start_op(c, real(c));
+}
+
+xcb_generic_event_t* xcb_poll_for_event(xcb_connection_t* c)
+{
+    static xcb_generic_event_t* (*real)(xcb_connection_t*) = NULL;
+    real = real ? real : next_symbol("xcb_poll_for_event");
+    return start_op(c, real(c));
+}
+
+xcb_generic_event_t* xcb_poll_for_queued_event(xcb_connection_t* c)
+{
+    static xcb_generic_event_t* (*real)(xcb_connection_t*) = NULL;
+    real = real ? real : next_symbol("xcb_poll_for_queued_event");
+    return start_op(c, real(c));
+}
+
+// Every request ends up here, syncs inserted by xcb_request_check are only visible as bytes
+uint64_t xcb_send_request_with_fds64(xcb_connection_t* c, int flags, struct iovec* vector, const xcb_protocol_request_t* request, unsigned int num_fds, int* fds)
+{
+    static uint64_t (*real)(xcb_connection_t*, int, struct iovec*, const xcb_protocol_request_t*, unsigned int, int*) = NULL;
+    real = real ? real : next_symbol("xcb_send_request_with_fds64");
+    x_fd = xcb_get_file_descriptor(c);
+    current.requests++;
+    return real(c, flags, vector, request, num_fds, fds);
+}
+
+void* xcb_wait_for_reply(xcb_connection_t* c, unsigned int request, xcb_generic_error_t** e)
+{
+    static void* (*real)(xcb_connection_t*, unsigned int, xcb_generic_error_t**) = NULL;
+    real = real ? real : next_symbol("xcb_wait_for_reply");
+    current.round_trips++;
+    return real(c, request, e);
+}
+
+void* xcb_wait_for_reply64(xcb_connection_t* c, uint64_t request, xcb_generic_error_t** e)
+{
+    static void* (*real)(xcb_connection_t*, uint64_t, xcb_generic_error_t**) = NULL;
+    real = real ? real : next_symbol("xcb_wait_for_reply64");
+    current.round_trips++;
+    return real(c, request, e);
+}
+
+xcb_generic_error_t* xcb_request_check(xcb_connection_t* c, xcb_void_cookie_t cookie)
+{
+    static xcb_generic_error_t* (*real)(xcb_connection_t*, xcb_void_cookie_t) = NULL;
+    real = real ? real : next_symbol("xcb_request_check");
+    current.round_trips++;
+    return real(c, cookie);
+}
+
+static void count_write(int fd, ssize_t written)
+{
+    if (fd == x_fd && written > 0)
+    {
+        current.bytes += written;
+        current.last_write = now_us();
+    }
+}
+
+ssize_t writev(int fd, const struct iovec* iov, int iovcnt)
+{
+    static ssize_t (*real)(int, const struct iovec*, int) = NULL;
+    real = real ? real : next_symbol("writev");
+    ssize_t written = real(fd, iov, iovcnt);
+    count_write(fd, written);
+    return written;
+}
+
+ssize_t sendmsg(int fd, const struct msghdr* msg, int flags)
+{
+    static ssize_t (*real)(int, const struct msghdr*, int) = NULL;
+    real = real ? real : next_symbol("sendmsg");
+    ssize_t written = real(fd, msg, flags);
+    count_write(fd, written);
+    return written;
+}
+
+__attribute__((constructor)) static void bench_init()
+{
+    current.start = now_us();
+}
+
+__attribute__((destructor)) static void bench_fini()
+{
+    if (pending)
+        finish_op();
+    if (out && out != stderr)
+        fclose(out);
+}
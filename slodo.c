@@ -1,10 +1,17 @@
+#include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include <X11/Xlib.h>
 #include <xcb/xcb.h>
 #include <xcb/xcb_keysyms.h>
 
 #include "text.h"
+#include "cli.h"
 
 // Modify background and foreground colors if needed
 #define BG_COLOR "#262626"
@@ -14,14 +21,50 @@
 #define SHIFT_KEY 50
 #define ESCAPE_KEY 9
 
+#define LINE_MAX_LENGTH 254
+
+// Idle maintenance (recovery saving, compaction) runs once no key was pressed for this long
+#define IDLE_DELAY_MS 1000
+
+// Idle saves go to FILE.recovery, so quitting without saving still discards every edit
+// FILE.recovery.1 and so on are used while a crashed session's recovery file is still around
+#define RECOVERY_SUFFIX ".recovery"
+#define RECOVERY_MAX_FILES 100
+
 // Struct that contains everything needed for rendering a font
 typedef struct
 {
     xcb_gc_t font_gc;
     xcb_gc_t font_gc_inverted;
     uint16_t font_size;
+    uint16_t font_ascent;
+    uint16_t* char_width; // Advance width of every 8 bit char, from QueryFont
 } font_full_t;
 
+// Prefix sums of glyph widths for the line being written
+// prefix[i] is the width of the first i chars, lines never exceed LINE_MAX_LENGTH
+typedef struct
+{
+    uint32_t prefix[LINE_MAX_LENGTH + 1];
+    size_t size;
+    size_t scroll; // Index of the first visible char
+    size_t row;    // Row the line is drawn at
+    uint16_t window_width; // Kept up to date from ConfigureNotify, so scrolling needs no round trip
+} line_widths_t;
+
+// Line index meaning no line, e.g. when nothing is drawn selected
+#define NO_LINE SIZE_MAX
+
+// What render() has to draw at the end of a wake-up, key handlers only record it
+typedef struct
+{
+    bool full;             // Whole window, e.g. after Expose or when lines moved
+    bool selection;        // Selected line, and the line the marker moved away from
+    bool write_line;       // Line being written, or the one just finished with Enter
+    size_t drawn_selected; // Line the last render drew selected, NO_LINE if none
+    size_t drawn_row;      // Row drawn_selected was drawn at
+} dirty_t;
+
 typedef struct
 {
     uint16_t r, g, b;
@@ -39,6 +82,15 @@ typedef struct
     xcb_window_t window;
 } xcb_main;
 
+// File descriptors the main loop waits on
+typedef struct
+{
+    int epoll_fd;
+    int x_fd;
+    int timer_fd;
+    int signal_fd;
+} event_loop_t;
+
 void test_cookie(xcb_main main, xcb_void_cookie_t cookie, char* err_msg)
 {
     xcb_generic_error_t* error = xcb_request_check(main.connection, cookie);
@@ -81,12 +133,63 @@ int get_line_count(xcb_main main, int text_height)
     return full_fit_count; // Assuming that the top and bottom both have ~10px margin
 }
 
-int get_char_count(xcb_main main, int text_width)
+uint32_t get_text_width(font_full_t font, const char* label)
 {
-    window_geom_t geometry = get_window_geometry(main);
-    text_width -= 7; // Counteracts font kerning?
-    int full_fit_count = (geometry.width - (geometry.width % text_width))/text_width;
-    return full_fit_count;
+    uint32_t width = 0;
+    for (; *label != '\0'; ++label)
+    {
+        width += font.char_width[(unsigned char) *label];
+    }
+
+    return width;
+}
+
+void line_widths_reset(line_widths_t* widths, font_full_t font, const char* line)
+{
+    widths->size = 0;
+    widths->scroll = 0;
+    widths->prefix[0] = 0;
+    for (size_t i = 0; line[i] != '\0' && i < LINE_MAX_LENGTH; ++i)
+    {
+        widths->prefix[i+1] = widths->prefix[i] + font.char_width[(unsigned char) line[i]];
+        widths->size++;
+    }
+}
+
+void line_widths_push(line_widths_t* widths, font_full_t font, char c)
+{
+    widths->prefix[widths->size+1] = widths->prefix[widths->size] + font.char_width[(unsigned char) c];
+    widths->size++;
+}
+
+void line_widths_pop(line_widths_t* widths)
+{
+    widths->size--;
+    if (widths->scroll > widths->size)
+        widths->scroll = widths->size;
+}
+
+// Scrolls so that the end of the line and the cursor fit into available_width
+void line_widths_scroll(line_widths_t* widths, uint32_t cursor_width, uint32_t available_width)
+{
+    uint32_t end = widths->prefix[widths->size] + cursor_width;
+    if (end <= available_width)
+    {
+        widths->scroll = 0;
+        return;
+    }
+
+    // Smallest index whose prefix leaves the rest of the line visible
+    size_t low = 0, high = widths->size;
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+        if (end - widths->prefix[mid] <= available_width)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    widths->scroll = low;
 }
 
 int text_draw_base(xcb_main main, font_full_t font, todo_text_t* t, bool flush)
@@ -104,47 +207,119 @@ int text_draw_base(xcb_main main, font_full_t font, todo_text_t* t, bool flush)
     return 0;
 }
 
+// Draws a todo line at row, marking collapsed subtrees
+void draw_todo_line(xcb_main main, font_full_t font, todo_text_t* t, size_t index, size_t row, xcb_gcontext_t gc)
+{
+    int16_t y = 10 + (font.font_size * row);
+    draw_text_internal(main, 1, y, t->data[index], gc);
+    if (t->collapsed[index] && t->subtree[index] > 1)
+    {
+        draw_text_internal(main, 1 + get_text_width(font, t->data[index]), y, " ...", gc);
+    }
+}
+
 // XCB Draw commands go here
 void text_draw_redraw(xcb_main main, font_full_t font, todo_text_t* t)
 {
     if(text_draw_base(main, font, t, true))
     {
-        for (int i = 0; (i < get_line_count(main, font.font_size)) && (i < t->size); ++i)
+        int line_count = get_line_count(main, font.font_size);
+        int row = 0;
+        for (size_t i = 0; (row < line_count) && (i < t->size); i = text_next_visible(t, i), ++row)
         {
-            draw_text_internal(main, 1, 10 + ((font.font_size) * i), t->data[i], font.font_gc);
+            draw_todo_line(main, font, t, i, row, font.font_gc);
         }
-        draw_text_internal(main, 1, 10 + ((font.font_size) * t->selected), t->data[t->selected], font.font_gc_inverted);
+        draw_todo_line(main, font, t, t->selected, t->selected_row, font.font_gc_inverted);
     }
 }
 
-void text_draw_redraw_write(xcb_main main, font_full_t font, todo_text_t* t)
+// Draws the line being written, scrolled right if it doesn't fit the window
+void text_draw_write_line(xcb_main main, font_full_t font, todo_text_t* t, line_widths_t* widths, bool cursor)
+{
+    int16_t y = 10 + (font.font_size * widths->row);
+    uint32_t cursor_width = font.char_width[' '];
+    uint16_t window_width = widths->window_width;
+    line_widths_scroll(widths, cursor_width, window_width > 1 ? window_width - 1 : 0);
+
+    int16_t cursor_x = 1 + widths->prefix[widths->size] - widths->prefix[widths->scroll];
+    draw_text_internal(main, 1, y, &t->data[t->size-1][widths->scroll], font.font_gc);
+    draw_text_internal(main, cursor_x, y, " ", cursor ? font.font_gc_inverted : font.font_gc);
+
+    // Clear leftovers of longer text, e.g. after a backspace
+    int16_t clear_x = cursor_x + cursor_width;
+    if (clear_x < window_width)
+        xcb_clear_area(main.connection, 0, main.window, clear_x, y - font.font_ascent, window_width - clear_x, font.font_size);
+}
+
+void text_draw_redraw_write(xcb_main main, font_full_t font, todo_text_t* t, line_widths_t* widths)
 {
     if(text_draw_base(main, font, t, true))
     {
-        for (int i = 0; (i < get_line_count(main, font.font_size)) && (i < t->size); ++i)
+        int line_count = get_line_count(main, font.font_size);
+        int row = 0;
+        for (size_t i = 0; (row < line_count) && (i + 1 < t->size); i = text_next_visible(t, i), ++row)
         {
-            draw_text_internal(main, 1, 10 + ((font.font_size) * i), t->data[i], font.font_gc);
+            draw_todo_line(main, font, t, i, row, font.font_gc);
         }
-        draw_text_internal(main, 1 + ((font.font_size-7) * (strlen(t->data[t->size-1]))), 10+ (font.font_size * (t->size - 1)), " ", font.font_gc_inverted);
+        text_draw_write_line(main, font, t, widths, true);
     }
 }
-void text_draw_toggle(xcb_main main, font_full_t font, todo_text_t* t)
+// Draws the selected line, and unmarks previous at its row if the selection moved away from it
+void text_draw_selection(xcb_main main, font_full_t font, todo_text_t* t, size_t previous, size_t previous_row)
 {
     if(text_draw_base(main, font, t, false))
     {
-        draw_text_internal(main, 1, 10 + ((font.font_size) * t->selected), t->data[t->selected], font.font_gc_inverted);
+        if (previous != NO_LINE && previous != t->selected)
+            draw_todo_line(main, font, t, previous, previous_row, font.font_gc);
+        draw_todo_line(main, font, t, t->selected, t->selected_row, font.font_gc_inverted);
     }
 }
-void text_draw_move(xcb_main main, font_full_t font, todo_text_t* t, bool up)
+
+// Builds a width table for every 8 bit char, so text can be measured without round trips
+uint16_t* get_char_widths(xcb_query_font_reply_t* font_reply)
 {
-    if(text_draw_base(main, font, t, false))
+    uint16_t* widths = malloc(256 * sizeof(uint16_t));
+    if (!widths)
     {
-        if (up)
-            draw_text_internal(main, 1, 10+ (font.font_size * (t->selected+1)), t->data[t->selected+1], font.font_gc);
-        else
-            draw_text_internal(main, 1, 10+ (font.font_size * (t->selected-1)), t->data[t->selected-1], font.font_gc);
-        draw_text_internal(main, 1, 10 + ((font.font_size) * t->selected), t->data[t->selected], font.font_gc_inverted);
+        fprintf(stderr, "ERROR: Failed to allocate memory for font widths\n");
+        exit(-1);
+    }
+
+    xcb_charinfo_t* infos = xcb_query_font_char_infos(font_reply);
+    int info_count = xcb_query_font_char_infos_length(font_reply);
+
+    // Server omits per char info when all chars share the same metrics
+    if (info_count == 0)
+    {
+        for (int c = 0; c < 256; ++c)
+            widths[c] = font_reply->max_bounds.character_width;
+        return widths;
+    }
+
+    // xcb_image_text_8 only reaches the first row of a matrix font
+    int first = font_reply->min_char_or_byte2;
+    int last = font_reply->max_char_or_byte2;
+    bool has_row = font_reply->min_byte1 == 0;
+
+    // Nonexistent chars are drawn as default_char, or not at all if it doesn't exist either
+    uint16_t default_width = 0;
+    int default_char = font_reply->default_char;
+    if (has_row && default_char >= first && default_char <= last && default_char - first < info_count)
+        default_width = infos[default_char - first].character_width;
+
+    for (int c = 0; c < 256; ++c)
+    {
+        widths[c] = default_width;
+        if (has_row && c >= first && c <= last && c - first < info_count)
+        {
+            xcb_charinfo_t info = infos[c - first];
+            bool exists = info.character_width || info.left_side_bearing || info.right_side_bearing || info.ascent || info.descent;
+            if (exists)
+                widths[c] = info.character_width;
+        }
     }
+
+    return widths;
 }
 
 font_full_t get_font_full(xcb_main main, const char* font_name, uint32_t background, uint32_t foreground)
@@ -161,6 +336,8 @@ font_full_t get_font_full(xcb_main main, const char* font_name, uint32_t backgro
     xcb_query_font_reply_t* font_reply = xcb_query_font_reply(main.connection, query_cookie, NULL);
 
     font_full.font_size = font_reply->font_ascent + font_reply->font_descent;
+    font_full.font_ascent = font_reply->font_ascent;
+    font_full.char_width = get_char_widths(font_reply);
 
     // Create graphics context
     if (background != 0 && foreground != 0)
@@ -264,9 +441,10 @@ xcb_main create_xcb_main(int line_count)
 
     char* background_color = BG_COLOR;
     values[0] = get_color_pixel(main, background_color);
-    values[1] = XCB_EVENT_MASK_KEY_PRESS | XCB_EVENT_MASK_KEY_RELEASE | XCB_EVENT_MASK_EXPOSURE;
+    values[1] = XCB_EVENT_MASK_KEY_PRESS | XCB_EVENT_MASK_KEY_RELEASE | XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_STRUCTURE_NOTIFY;
 
     font_full_t font = get_font_full(main, FONT_NAME, 0, 0);
+    free(font.char_width);
 
     xcb_void_cookie_t windowCookie = xcb_create_window_checked(main.connection,
             main.screen->root_depth,
@@ -291,50 +469,38 @@ xcb_main create_xcb_main(int line_count)
     return main;
 }
 
-// Increase window size by one text line height
-void increase_window_size(xcb_main main, font_full_t font)
-{
-    uint32_t value =  get_window_geometry(main).height + font.font_size;
-    value = value < font.font_size ? font.font_size : value;
-    xcb_configure_window(main.connection, main.window, XCB_CONFIG_WINDOW_HEIGHT, &value);
-}
-
-// Decrease window size by one text line height
-void decrease_window_size(xcb_main main, font_full_t font)
+// Resize window to fit line_count text lines and the mode line
+void resize_window(xcb_main main, font_full_t font, size_t line_count)
 {
-    uint32_t value =  get_window_geometry(main).height - font.font_size;
-    value = value < font.font_size ? font.font_size : value;
+    uint32_t value = (line_count + 1) * font.font_size;
     xcb_configure_window(main.connection, main.window, XCB_CONFIG_WINDOW_HEIGHT, &value);
 }
 
 // Returns true if mode is write, false if manage
-bool process_event_write(xcb_main main, xcb_key_press_event_t *kp, xcb_key_symbols_t *key_syms, font_full_t font, todo_text_t* text, bool upper_case)
+bool process_event_write(xcb_main main, xcb_key_press_event_t *kp, xcb_key_symbols_t *key_syms, font_full_t font, todo_text_t* text, line_widths_t* widths, bool upper_case, dirty_t* dirty)
 {
     static uint8_t current_char = 0;
     if (kp->detail == 36) // Enter key
     {
         current_char = 0;
 
-        draw_text_internal(main, 1 + ((font.font_size-7) * (strlen(text->data[text->size-1]))), 10+ (font.font_size * (text->size - 1)), " ", font.font_gc);
-
         // Nothing was typed, so we don't save it
         if (text_last_empty(text))
         {
             text_remove(text, text->size - 1);
-            draw_text_internal(main, 1, 10+ (font.font_size * (text->size)), "     ", font.font_gc);
-            decrease_window_size(main, font);
+            resize_window(main, font, text->visible);
+            dirty->full = true;
         }
-
-        if (text->size != 0)
+        else
         {
-            text->selected = text->size-1;
-            draw_text_internal(main, 1, 10+ (font.font_size * (text->selected)), text->data[text->selected], font.font_gc_inverted);
+            dirty->write_line = true;
         }
-        else
+
+        if (text->size != 0)
         {
-            decrease_window_size(main, font);
+            text_select_last(text);
+            dirty->selection = true;
         }
-        draw_text_internal(main, 1, 10 + (font.font_size * text->size), "NORMAL", font.font_gc);
 
         return false;
     }
@@ -342,67 +508,57 @@ bool process_event_write(xcb_main main, xcb_key_press_event_t *kp, xcb_key_symbo
     xcb_keysym_t y = xcb_key_press_lookup_keysym(key_syms, kp, (int) upper_case);
     char* string = XKeysymToString(y);
 
-    // TODO Allow user to scroll right of current line
-    int offset = current_char + 6 - get_char_count(main, font.font_size);
-    offset = offset < 0 ? 0 : offset;
-
     if (y == 0 || strcmp(string, "space") == 0)
     {
-        text->data[text->size-1][current_char+4] = ' ';
-        text->data[text->size-1][current_char+5] = '\0';
-        draw_text_internal(main, 1, 10+ (font.font_size * (text->size - 1)), &text->data[text->size-1][offset], font.font_gc);
-        current_char++;
-        draw_text_internal(main, 1 + ((font.font_size-7) * (strlen(text->data[text->size-1]))), 10+ (font.font_size * (text->size - 1)), " ", font.font_gc_inverted);
+        if (current_char + 4 < LINE_MAX_LENGTH)
+        {
+            text->data[text->size-1][current_char+4] = ' ';
+            text->data[text->size-1][current_char+5] = '\0';
+            line_widths_push(widths, font, ' ');
+            current_char++;
+            dirty->write_line = true;
+        }
     }
     else if (strcmp(string, "BackSpace") == 0)
     {
         if (current_char != 0)
         {
-            offset -= 2; // Don't know why it's -2, just how it is.
-            offset = offset < 0 ? 0 : offset;
-
-            draw_text_internal(main, 1 + ((font.font_size-7) * (strlen(text->data[text->size-1]))), 10+ (font.font_size * (text->size - 1)), " ", font.font_gc);
             text->data[text->size-1][current_char+3] = '\0';
-            draw_text_internal(main, 1, 10+ (font.font_size * (text->size - 1)), &text->data[text->size-1][offset], font.font_gc);
-            draw_text_internal(main, 1 + ((font.font_size-7) * (strlen(text->data[text->size-1]))), 10+ (font.font_size * (text->size - 1)), " ", font.font_gc_inverted);
-
+            line_widths_pop(widths);
             current_char--;
+            dirty->write_line = true;
         }
     }
     else
     {
-        text->data[text->size-1][current_char+4] = y;
-        text->data[text->size-1][current_char+5] = '\0';
-        draw_text_internal(main, 1, 10+ (font.font_size * (text->size - 1)), &text->data[text->size-1][offset], font.font_gc);
-        current_char++;
-        draw_text_internal(main, 1 + ((font.font_size-7) * (strlen(text->data[text->size-1]))), 10+ (font.font_size * (text->size - 1)), " ", font.font_gc_inverted);
+        if (current_char + 4 < LINE_MAX_LENGTH)
+        {
+            text->data[text->size-1][current_char+4] = y;
+            text->data[text->size-1][current_char+5] = '\0';
+            line_widths_push(widths, font, y);
+            current_char++;
+            dirty->write_line = true;
+        }
     }
 
-    draw_text_internal(main, 1, 10 + (font.font_size * text->size), "INSERT", font.font_gc);
-
     return true;
 }
 
-bool process_event_manage(xcb_main main, xcb_key_press_event_t *kp, font_full_t font, todo_text_t* text, bool upper_case)
+bool process_event_manage(xcb_main main, xcb_key_press_event_t *kp, font_full_t font, todo_text_t* text, line_widths_t* widths, bool upper_case, dirty_t* dirty)
 {
     if (kp->detail == 32) // O
     {
-        // Remove selection marker if present
-        if (text->size != 0)
-        {
-            text_draw_base(main, font, text, text->size);
-            draw_text_internal(main, 1, 10+ (font.font_size * (text->selected)), text->data[text->selected], font.font_gc);
-        }
-        increase_window_size(main, font);
-
         text_append(text, NULL);
-        text->data[text->size - 1] = (char*) malloc(sizeof(char) * 255);
+        text->data[text->size - 1] = (char*) malloc(sizeof(char) * (LINE_MAX_LENGTH + 1));
         /* strcpy(text->data[text->size-1], "[ ] "); */
         strncpy(text->data[text->size-1], "[ ] ", 5);
 
-        draw_text_internal(main, 1, 10 + (font.font_size * (text->size - 1)), "[ ] ", font.font_gc);
-        draw_text_internal(main, 1 + ((font.font_size-7) * (strlen(text->data[text->size-1]))), 10+ (font.font_size * (text->size - 1)), " ", font.font_gc_inverted);
-        draw_text_internal(main, 1, 10 + (font.font_size * text->size), "INSERT", font.font_gc);
+        size_t line_count = text->visible;
+        resize_window(main, font, line_count);
+
+        line_widths_reset(widths, font, text->data[text->size - 1]);
+        widths->row = line_count - 1;
+        dirty->write_line = true;
 
         return true;
     }
@@ -411,56 +567,212 @@ bool process_event_manage(xcb_main main, xcb_key_press_event_t *kp, font_full_t
     {
         if (kp->detail == 45 && text->selected > 0) // K
         {
-            --text->selected;
-
             if (upper_case)
             {
-                text_swap(text, text->selected+1, text->selected);
-                text_draw_redraw(main, font, text);
+                if (text_move(text, true) == 0)
+                    dirty->full = true;
+            }
+            else if (text_select_prev(text) == 0)
+            {
+                dirty->selection = true;
             }
-            text_draw_move(main, font, text, true);
         }
-        else if (kp->detail == 44 && text->selected + 1 < text->size) // J
+        else if (kp->detail == 44) // J
         {
-            ++text->selected;
             if (upper_case)
             {
-                text_swap(text, text->selected - 1, text->selected);
-                text_draw_redraw(main, font, text);
+                if (text_move(text, false) == 0)
+                    dirty->full = true;
+            }
+            else if (text_select_next(text) == 0)
+            {
+                dirty->selection = true;
             }
-
-            text_draw_move(main, font, text, false);
         }
         else if (kp->detail == 40) // D
         {
-            if (text_set_completion(text))
+            int completion = text_set_completion(text);
+            if (completion == 1)
             {
-                decrease_window_size(main, font);
-                text_draw_redraw(main, font, text);
+                resize_window(main, font, text->visible);
+                dirty->full = true;
+            }
+            else if (completion == 0)
+                dirty->selection = true;
+        }
+        else if (kp->detail == 23) // Tab
+        {
+            if (text_toggle_collapse(text) == 0)
+            {
+                resize_window(main, font, text->visible);
+                dirty->full = true;
+            }
+        }
+        else if (kp->detail == 46 || kp->detail == 43) // L, H
+        {
+            if (text_indent(text, kp->detail == 46) == 0)
+            {
+                resize_window(main, font, text->visible);
+                dirty->full = true;
             }
-            else
-                text_draw_toggle(main, font, text);
         }
-
-        draw_text_internal(main, 1, 10 + (font.font_size * text->size), "NORMAL", font.font_gc);
     }
 
     return false;
 }
 
+void watch_fd(event_loop_t* loop, int fd)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        fprintf(stderr, "ERROR: Can't watch file descriptor : %d\n", errno);
+        exit(-1);
+    }
+}
+
+// Creates an epoll instance over the X connection, an idle timer and SIGTERM / SIGINT
+event_loop_t create_event_loop(xcb_main main)
+{
+    event_loop_t loop;
+
+    // Signals are only delivered through signal_fd, so they can't interrupt drawing
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop.x_fd = xcb_get_file_descriptor(main.connection);
+    loop.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (loop.epoll_fd == -1 || loop.timer_fd == -1 || loop.signal_fd == -1)
+    {
+        fprintf(stderr, "ERROR: Can't create event loop : %d\n", errno);
+        xcb_disconnect(main.connection);
+        exit(-1);
+    }
+
+    watch_fd(&loop, loop.x_fd);
+    watch_fd(&loop, loop.timer_fd);
+    watch_fd(&loop, loop.signal_fd);
+
+    return loop;
+}
+
+void free_event_loop(event_loop_t loop)
+{
+    close(loop.signal_fd);
+    close(loop.timer_fd);
+    close(loop.epoll_fd);
+}
+
+// (Re)starts the idle timer, so idle work never competes with a burst of key presses
+void arm_idle_timer(event_loop_t loop)
+{
+    struct itimerspec spec = { 0 };
+    spec.it_value.tv_sec = IDLE_DELAY_MS / 1000;
+    spec.it_value.tv_nsec = (IDLE_DELAY_MS % 1000) * 1000000;
+    timerfd_settime(loop.timer_fd, 0, &spec, NULL);
+}
+
+// Writes the recovery file, whose name the first write of a session picks
+// A file left by a crashed session may be the only copy of its edits, so it's never replaced
+int write_recovery_file(todo_text_t* text, const char* todo_file, char* recovery_file, size_t size, bool created)
+{
+    if (created)
+        return text_write_to_file(text, recovery_file, "w");
+
+    for (int i = 0; i < RECOVERY_MAX_FILES; ++i)
+    {
+        if (i == 0)
+            snprintf(recovery_file, size, "%s%s", todo_file, RECOVERY_SUFFIX);
+        else
+            snprintf(recovery_file, size, "%s%s.%d", todo_file, RECOVERY_SUFFIX, i);
+
+        if (text_write_to_file(text, recovery_file, "wx") == 0)
+            return 0;
+
+        // The file didn't exist before, so a partial write can go
+        if (errno != EEXIST)
+        {
+            int error = errno;
+            remove(recovery_file);
+            errno = error;
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+// Draws whatever the handled events left dirty, including the mode line
+void render(xcb_main main, font_full_t font, todo_text_t* text, line_widths_t* widths, bool write, dirty_t* dirty)
+{
+    if (!dirty->full && !dirty->selection && !dirty->write_line)
+        return;
+
+    if (dirty->full)
+    {
+        if (write)
+            text_draw_redraw_write(main, font, text, widths);
+        else
+            text_draw_redraw(main, font, text);
+    }
+    else
+    {
+        // A line finished with Enter loses its cursor, then gets selected
+        if (dirty->write_line)
+            text_draw_write_line(main, font, text, widths, write);
+
+        // Opening a line unmarks the selection, lines are drawn unselected while writing
+        if (write && dirty->drawn_selected != NO_LINE)
+            draw_todo_line(main, font, text, dirty->drawn_selected, dirty->drawn_row, font.font_gc);
+        else if (!write && dirty->selection)
+            text_draw_selection(main, font, text, dirty->drawn_selected, dirty->drawn_row);
+    }
+
+    char* mode_text = write ? "INSERT" : "NORMAL";
+    size_t line_count = write ? widths->row + 1 : text->visible;
+    draw_text_internal(main, 1, 10 + (font.font_size * line_count), mode_text, font.font_gc);
+
+    dirty->drawn_selected = write || text->size == 0 ? NO_LINE : text->selected;
+    dirty->drawn_row = text->selected_row;
+    dirty->full = false;
+    dirty->selection = false;
+    dirty->write_line = false;
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 2)
     {
         fprintf(stderr, "TODO file not specified!\n");
-        fprintf(stderr, "Usage: slodo <FILE>\n");
+        cli_usage();
         return -1;
     }
+
+    // Subcommands don't need an X connection, cli_main prints usage if the file is missing
+    if (cli_is_command(argv[1]))
+    {
+        return cli_main(argc, argv);
+    }
     char *todo_file = argv[1]; 
     todo_text_t text;
     text_init_from_file(&text, todo_file);
 
-    xcb_main main = create_xcb_main(text.size);
+    // Room for the ".N" of RECOVERY_MAX_FILES
+    char recovery_file[strlen(todo_file) + strlen(RECOVERY_SUFFIX) + 8];
+    snprintf(recovery_file, sizeof(recovery_file), "%s%s", todo_file, RECOVERY_SUFFIX);
+    if (access(recovery_file, F_OK) == 0)
+    {
+        fprintf(stderr, "WARNING: %s exists, a previous session didn't exit cleanly. It's kept, this session recovers to another file\n", recovery_file);
+    }
+
+    xcb_main main = create_xcb_main(text.visible);
     xcb_key_symbols_t *key_syms = xcb_key_symbols_alloc(main.connection);
 
     // Set background and foreground color
@@ -474,27 +786,34 @@ int main(int argc, char **argv)
 
     text_draw_base(main, font, &text, true);
     text_draw_redraw(main, font, &text);
-    draw_text_internal(main, 1, 10 + (font.font_size * text.size), "NORMAL", font.font_gc);
+    draw_text_internal(main, 1, 10 + (font.font_size * text.visible), "NORMAL", font.font_gc);
 
+    event_loop_t loop = create_event_loop(main);
     xcb_generic_event_t *event;
+    xcb_generic_event_t *queued = NULL;
+    line_widths_t widths;
+    widths.window_width = get_window_geometry(main).width;
 
     bool write = false;
     bool upper_case = false;
-    while(1)
+    bool running = true;
+    bool save = true;
+    dirty_t dirty = { 0 };
+    dirty.drawn_selected = text.size ? text.selected : NO_LINE;
+    dirty.drawn_row = text.selected_row;
+    bool recovery_written = false;
+    size_t recovered_version = text.version;
+    while (running)
     {
-        if ((event = xcb_wait_for_event(main.connection)))
+        // xcb may have queued events while waiting for a reply, so drain them before blocking
+        while (running && ((event = queued) || (event = xcb_poll_for_event(main.connection))))
         {
+            queued = NULL;
             uint8_t type = event->response_type & ~0x80;
             if (type == XCB_EXPOSE && text.size >= 1)
-            {
-                if (write)
-                    text_draw_redraw_write(main, font, &text);
-                else
-                    text_draw_redraw(main, font, &text);
-
-                char* mode_text = write ? "INSERT" : "NORMAL";
-                draw_text_internal(main, 1, 10 + (font.font_size * text.size), mode_text, font.font_gc);
-            }
+                dirty.full = true;
+            else if (type == XCB_CONFIGURE_NOTIFY)
+                widths.window_width = ((xcb_configure_notify_event_t*) event)->width;
             else if (type == XCB_KEY_RELEASE && ((xcb_key_release_event_t*) event)->detail == SHIFT_KEY)
                 upper_case = false;
             else if (type == XCB_KEY_PRESS)
@@ -504,34 +823,106 @@ int main(int argc, char **argv)
                     upper_case = true;
                 else if (kp->detail == ESCAPE_KEY)
                 {
-                    if (write && text_last_empty(&text))
-                    {
-                        text_remove(&text, text.size - 1);
-                    }
-
-                    break;
+                    running = false;
+                    save = !upper_case;
                 }
-                else if (write)
-                    write = process_event_write(main, (xcb_key_press_event_t*) event, key_syms, font, &text, upper_case);
                 else
-                    write = process_event_manage(main, (xcb_key_press_event_t*) event, font, &text, upper_case);
+                {
+                    if (write)
+                        write = process_event_write(main, kp, key_syms, font, &text, &widths, upper_case, &dirty);
+                    else
+                        write = process_event_manage(main, kp, font, &text, &widths, upper_case, &dirty);
+
+                    // Keep pushing idle work back while keys arrive, but only if there is any
+                    if (text.version != recovered_version)
+                        arm_idle_timer(loop);
+                }
             }
 
             free(event);
         }
+
+        if (xcb_connection_has_error(main.connection))
+        {
+            fprintf(stderr, "ERROR: Lost connection to the X server\n");
+            break;
+        }
+
+        if (!running)
+            break;
+
+        // Render once per wake-up, no matter how many events were handled
+        render(main, font, &text, &widths, write, &dirty);
+        xcb_flush(main.connection);
+
+        // Rendering and flushing can read events into xcb's queue, the socket then looks empty to epoll
+        if ((queued = xcb_poll_for_queued_event(main.connection)))
+            continue;
+
+        struct epoll_event ready[3];
+        int ready_count = epoll_wait(loop.epoll_fd, ready, 3, -1);
+        if (ready_count == -1 && errno != EINTR)
+        {
+            fprintf(stderr, "ERROR: Failed waiting for events : %d\n", errno);
+            break;
+        }
+
+        for (int i = 0; i < ready_count; ++i)
+        {
+            if (ready[i].data.fd == loop.signal_fd)
+            {
+                struct signalfd_siginfo info;
+                while (read(loop.signal_fd, &info, sizeof(info)) == sizeof(info))
+                    running = false;
+            }
+            else if (ready[i].data.fd == loop.timer_fd)
+            {
+                // Nothing to read means a key press rearmed the timer after epoll saw it expire
+                uint64_t expirations;
+                if (read(loop.timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                    continue;
+
+                // A line being written isn't saved until Enter, which restarts the timer
+                // Failing to save a recovery file mustn't cost the edits, they can still be saved on exit
+                if (!write && text.version != recovered_version)
+                {
+                    if (write_recovery_file(&text, todo_file, recovery_file, sizeof(recovery_file), recovery_written) == 0)
+                    {
+                        recovered_version = text.version;
+                        recovery_written = true;
+                    }
+                    else
+                        fprintf(stderr, "ERROR: Failed to write recovery file (%s) : %d\n", recovery_file, errno);
+                    text_compact(&text);
+                }
+            }
+            // X events are read by the xcb_poll_for_event loop
+        }
     }
 
-    free(event);
+    if (write && text_last_empty(&text))
+    {
+        text_remove(&text, text.size - 1);
+    }
+
+    free_event_loop(loop);
     xcb_free_gc(main.connection, font.font_gc);
     xcb_free_gc(main.connection, font.font_gc_inverted);
+    free(font.char_width);
     xcb_key_symbols_free(key_syms);
     xcb_disconnect(main.connection);
 
-    if (!upper_case)
+    if (save)
     {
         text_commit_to_file(&text, todo_file);
     }
 
+    // Exiting cleanly, whether saving or discarding, makes the recovery file obsolete
+    if (recovery_written)
+    {
+        remove(recovery_file);
+    }
+
     text_free(&text);
     return 0;
 }
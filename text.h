@@ -1,24 +1,43 @@
 #ifndef TEXT_H
 #define TEXT_H
 
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #define EMPTY_TEXT "[ ] "
 
+// Subtasks are lines indented by INDENT_WIDTH spaces more than their parent
+#define INDENT_WIDTH 2
+#define NO_PARENT SIZE_MAX
+
+// Lines form an implicit tree in file order, a subtree is a line followed by all deeper lines
 typedef struct
 {
 	char** data;
+	size_t* subtree;  // Amount of lines in the subtree of each line, including itself
+	size_t* parent;   // Index of the parent line, NO_PARENT for top level lines
+	bool* collapsed;  // Collapsed lines hide the rest of their subtree
 	size_t capacity;
 	size_t size;
 	size_t selected;
+	size_t selected_row; // Row the selected line is drawn at
+	size_t visible;      // Amount of lines not hidden by a collapsed ancestor
+	size_t version;      // Incremented whenever the lines change, collapsing doesn't count
 } todo_text_t;
 
 int text_init(todo_text_t* t, size_t init_capacity)
 {
 	t->data = malloc(init_capacity * sizeof(char*));
-	if (!t->data)
+	t->subtree = malloc(init_capacity * sizeof(size_t));
+	t->parent = malloc(init_capacity * sizeof(size_t));
+	t->collapsed = malloc(init_capacity * sizeof(bool));
+	if (!t->data || !t->subtree || !t->parent || !t->collapsed)
 	{
 		return -1;
 	}
@@ -26,6 +45,9 @@ int text_init(todo_text_t* t, size_t init_capacity)
 	t->size = 0;
 	t->capacity = init_capacity;
 	t->selected = 0;
+	t->selected_row = 0;
+	t->visible = 0;
+	t->version = 0;
 
 	return 0;
 }
@@ -38,9 +60,151 @@ int text_free(todo_text_t* t)
 	}
 
 	free(t->data);
+	free(t->subtree);
+	free(t->parent);
+	free(t->collapsed);
+	return 0;
+}
+
+// Returns the nesting depth of line, based on its indentation
+size_t text_depth(const char* line)
+{
+	size_t spaces = strspn(line, " ");
+	return spaces / INDENT_WIDTH;
+}
+
+// Returns the completion marker of line, i.e. the line without its indentation
+char* text_marker(char* line)
+{
+	return &line[strspn(line, " ")];
+}
+
+// Returns 1 if line starts with a "[?]" completion marker after its indentation
+// Any other line is plain text that completion leaves alone
+int text_is_item(const char* line)
+{
+	line = &line[strspn(line, " ")];
+	return line[0] == '[' && line[1] != '\0' && line[2] == ']' && (line[3] == ' ' || line[3] == '\0');
+}
+
+// Returns 1 if line is marked as completed, lines without a marker never are
+int text_line_completed(const char* line)
+{
+	return text_is_item(line) && line[strspn(line, " ") + 1] != ' ';
+}
+
+// Recomputes parent and subtree of the lines in [start, end)
+// The range has to consist of whole subtrees whose top level lines are children of parent
+void text_update_tree_range(todo_text_t* t, size_t start, size_t end, size_t parent)
+{
+	size_t open = parent;
+	for (size_t i = start; i < end; ++i)
+	{
+		size_t depth = text_depth(t->data[i]);
+		while (open != parent && text_depth(t->data[open]) >= depth)
+		{
+			open = t->parent[open];
+		}
+
+		t->parent[i] = open;
+		t->subtree[i] = 1;
+		open = i;
+	}
+
+	for (size_t i = end; i-- > start;)
+	{
+		if (t->parent[i] != parent)
+		{
+			t->subtree[t->parent[i]] += t->subtree[i];
+		}
+	}
+}
+
+void text_update_tree(todo_text_t* t)
+{
+	text_update_tree_range(t, 0, t->size, NO_PARENT);
+}
+
+// Returns the next line that isn't hidden by a collapsed ancestor, skipping collapsed subtrees whole
+size_t text_next_visible(todo_text_t* t, size_t index)
+{
+	return index + (t->collapsed[index] ? t->subtree[index] : 1);
+}
+
+// Returns the last visible line before index, index has to be > 0 and may be t->size
+size_t text_prev_visible(todo_text_t* t, size_t index)
+{
+	// The outermost collapsed ancestor hides the previous line
+	size_t visible = index - 1;
+	for (size_t p = t->parent[index - 1]; p != NO_PARENT; p = t->parent[p])
+	{
+		if (t->collapsed[p])
+		{
+			visible = p;
+		}
+	}
+
+	return visible;
+}
+
+// Returns the rows taken by the subtree of a visible line, collapsed subtrees inside are skipped whole
+size_t text_subtree_rows(todo_text_t* t, size_t index)
+{
+	size_t rows = 0;
+	for (size_t i = index; i < index + t->subtree[index]; i = text_next_visible(t, i))
+	{
+		++rows;
+	}
+
+	return rows;
+}
+
+// Recounts visible and selected_row after changes that can reshape the whole tree
+void text_update_rows(todo_text_t* t)
+{
+	t->visible = 0;
+	for (size_t i = 0; i < t->size; i = text_next_visible(t, i))
+	{
+		if (i == t->selected)
+		{
+			t->selected_row = t->visible;
+		}
+		++t->visible;
+	}
+}
+
+// Selection moves only step over a single visible row, so selected_row stays cached
+int text_select_next(todo_text_t* t)
+{
+	size_t next = text_next_visible(t, t->selected);
+	if (next >= t->size)
+	{
+		return -1;
+	}
+
+	t->selected = next;
+	t->selected_row++;
 	return 0;
 }
 
+int text_select_prev(todo_text_t* t)
+{
+	if (t->selected == 0)
+	{
+		return -1;
+	}
+
+	t->selected = text_prev_visible(t, t->selected);
+	t->selected_row--;
+	return 0;
+}
+
+void text_select_last(todo_text_t* t)
+{
+	t->selected = t->size ? text_prev_visible(t, t->size) : 0;
+	t->selected_row = t->visible ? t->visible - 1 : 0;
+}
+
 // Append text line
 // Creates empty line if text == NULL
 int text_append(todo_text_t* t, const char* text)
@@ -53,18 +217,48 @@ int text_append(todo_text_t* t, const char* text)
 		}
 
 		t->data = realloc(t->data, t->capacity * sizeof(char*) * 2);
+		t->subtree = realloc(t->subtree, t->capacity * sizeof(size_t) * 2);
+		t->parent = realloc(t->parent, t->capacity * sizeof(size_t) * 2);
+		t->collapsed = realloc(t->collapsed, t->capacity * sizeof(bool) * 2);
 		t->capacity = t->capacity * 2;
 	}
 
 	if (text != NULL)
 		t->data[t->size] = strdup(text);
-    else
-        t->data[t->size] = "";
+	else
+		t->data[t->size] = "";
+
+	// The new line closes every open line that isn't shallower than it
+	size_t index = t->size;
+	size_t depth = text_depth(t->data[index]);
+	size_t parent = index == 0 ? NO_PARENT : index - 1;
+	while (parent != NO_PARENT && text_depth(t->data[parent]) >= depth)
+	{
+		parent = t->parent[parent];
+	}
+
+	t->parent[index] = parent;
+	t->subtree[index] = 1;
+	t->collapsed[index] = false;
+	bool hidden = false;
+	for (size_t p = parent; p != NO_PARENT; p = t->parent[p])
+	{
+		t->subtree[p]++;
+		hidden = hidden || t->collapsed[p];
+	}
+
+	if (!hidden)
+	{
+		t->visible++;
+	}
 
 	t->size++;
+	t->version++;
 	return 0;
 }
 
+// Removes the visible line at index together with its subtree
+// A selection after the subtree is kept, callers have to move a selection inside it
 int text_remove(todo_text_t* t, size_t index)
 {
 	if (index >= t->size)
@@ -72,40 +266,185 @@ int text_remove(todo_text_t* t, size_t index)
 		return -1;
 	}
 
-	// Free char* at removal index
-	free(t->data[index]);
+	size_t count = t->subtree[index];
+	size_t rows = text_subtree_rows(t, index);
+	t->visible -= rows;
+	if (t->selected >= index + count)
+	{
+		t->selected -= count;
+		t->selected_row -= rows;
+	}
+
+	// Free char* of the whole subtree
+	for (size_t i = index; i < index + count; ++i)
+	{
+		free(t->data[i]);
+	}
 
-	// If index wasn't the last item, move memory
-	if (index + 1 != t->size)
+	// If subtree wasn't at the end, move memory
+	if (index + count != t->size)
 	{
-		size_t copy_size = t->size - (index+1);
-		memmove(&t->data[index], &t->data[index+1], copy_size * sizeof(char*));
+		size_t copy_size = t->size - (index+count);
+		memmove(&t->data[index], &t->data[index+count], copy_size * sizeof(char*));
+		memmove(&t->collapsed[index], &t->collapsed[index+count], copy_size * sizeof(bool));
 	}
 
-	t->size--;
+	t->size -= count;
+	t->version++;
+	text_update_tree(t);
 	return 0;
 }
 
-// Swaps src text with dst text
-int text_swap(todo_text_t* t, size_t src, size_t dst)
+void text_reverse(todo_text_t* t, size_t start, size_t end)
 {
-	if (src < 0 || dst < 0 || src >= t->size || dst >= t->size)
+	while (start + 1 < end)
+	{
+		--end;
+		char* temp = t->data[start];
+		t->data[start] = t->data[end];
+		t->data[end] = temp;
+
+		bool collapsed = t->collapsed[start];
+		t->collapsed[start] = t->collapsed[end];
+		t->collapsed[end] = collapsed;
+		++start;
+	}
+}
+
+// Moves the subtree of the selected line past its previous or next sibling subtree
+// Returns -1 if there's no sibling to move past
+int text_move(todo_text_t* t, bool up)
+{
+	size_t first, middle, end;
+	size_t index = t->selected;
+	if (up)
+	{
+		if (index == 0)
+		{
+			return -1;
+		}
+
+		// Previous sibling is the ancestor of the previous line that shares our parent
+		size_t sibling = index - 1;
+		while (sibling != NO_PARENT && t->parent[sibling] != t->parent[index])
+		{
+			sibling = t->parent[sibling];
+		}
+		if (sibling == NO_PARENT)
+		{
+			return -1;
+		}
+
+		first = sibling;
+		middle = index;
+		end = index + t->subtree[index];
+		t->selected = first;
+		t->selected_row -= text_subtree_rows(t, sibling);
+	}
+	else
+	{
+		size_t sibling = index + t->subtree[index];
+		if (sibling >= t->size || t->parent[sibling] != t->parent[index])
+		{
+			return -1;
+		}
+
+		first = index;
+		middle = sibling;
+		end = sibling + t->subtree[sibling];
+		t->selected = first + (end - middle);
+		t->selected_row += text_subtree_rows(t, sibling);
+	}
+
+	// Swap the two adjacent blocks by reversing both and then the whole range
+	text_reverse(t, first, middle);
+	text_reverse(t, middle, end);
+	text_reverse(t, first, end);
+	text_update_tree_range(t, first, end, t->parent[first]);
+	t->version++;
+
+	return 0;
+}
+
+// Changes the indentation of the selected subtree by one level
+// Returns -1 if the selected line can't be indented / outdented
+int text_indent(todo_text_t* t, bool increase)
+{
+	size_t index = t->selected;
+	size_t depth = text_depth(t->data[index]);
+	if (increase && (index == 0 || text_depth(t->data[index - 1]) < depth))
+	{
+		return -1; // Needs a previous sibling to become its child
+	}
+	if (!increase && depth == 0)
 	{
 		return -1;
 	}
 
-	if (src == dst)
+	for (size_t i = index; i < index + t->subtree[index]; ++i)
 	{
-		return 0;
+		size_t length = strlen(t->data[i]);
+		char* line;
+		if (increase)
+		{
+			line = malloc(length + INDENT_WIDTH + 1);
+			memset(line, ' ', INDENT_WIDTH);
+			memcpy(&line[INDENT_WIDTH], t->data[i], length + 1);
+		}
+		else
+		{
+			line = strdup(&t->data[i][INDENT_WIDTH]);
+		}
+
+		free(t->data[i]);
+		t->data[i] = line;
 	}
 
-	char* temp = t->data[dst];
-	t->data[dst] = t->data[src];
-	t->data[src] = temp;
+	text_update_tree(t);
 
+	// Selected line must stay visible under its new parent
+	for (size_t p = t->parent[index]; p != NO_PARENT; p = t->parent[p])
+	{
+		t->collapsed[p] = false;
+	}
+
+	text_update_rows(t);
+	t->version++;
 	return 0;
 }
 
+// Collapses or expands the selected subtree
+// Returns -1 if the selected line has no subtasks
+int text_toggle_collapse(todo_text_t* t)
+{
+	if (t->size == 0 || t->subtree[t->selected] == 1)
+	{
+		return -1;
+	}
+
+	// Only rows inside the subtree appear or disappear, the selected line keeps its row
+	size_t rows = text_subtree_rows(t, t->selected);
+	t->collapsed[t->selected] = !t->collapsed[t->selected];
+	t->visible = t->visible - rows + text_subtree_rows(t, t->selected);
+	return 0;
+}
+
+// Gives back memory left over after many removals
+void text_compact(todo_text_t* t)
+{
+	size_t capacity = t->size * 2 < 2 ? 2 : t->size * 2;
+	if (t->capacity <= capacity * 2)
+	{
+		return;
+	}
+
+	t->data = realloc(t->data, capacity * sizeof(char*));
+	t->subtree = realloc(t->subtree, capacity * sizeof(size_t));
+	t->parent = realloc(t->parent, capacity * sizeof(size_t));
+	t->collapsed = realloc(t->collapsed, capacity * sizeof(bool));
+	t->capacity = capacity;
+}
+
 void text_init_from_file(todo_text_t* t, const char* path)
 {
 	FILE* fp;
@@ -157,54 +496,214 @@ void text_init_from_file(todo_text_t* t, const char* path)
 	}
 }
 
-void text_commit_to_file(todo_text_t* t, const char* path)
+// Writes every line to path, opened with fopen mode, e.g. "wx" to never replace an existing file
+// Returns -1 with errno set if path can't be written, without printing anything
+int text_write_to_file(todo_text_t* t, const char* path, const char* mode)
 {
-	FILE* fp;
-	char* line = NULL;
-	size_t len = 0;
-	ssize_t read;
-	size_t lines = 0;
-
-	fp = fopen(path, "w");
+	FILE* fp = fopen(path, mode);
 	if (fp == NULL)
 	{
-		fprintf(stderr, "ERROR: Failed to open file (%s)", path);
-		exit(-1);
+		return -1;
 	}
 
-	for(size_t i = 0; i < t->size; ++i)
+	int result = 0;
+	for(size_t i = 0; i < t->size && result == 0; ++i)
 	{
 		size_t length = strlen(t->data[i]);
 		t->data[i][length] = '\n';
-		fwrite(t->data[i], sizeof(char), length+1, fp);
+		if (fwrite(t->data[i], sizeof(char), length+1, fp) != length+1)
+		{
+			result = -1;
+		}
 		t->data[i][length] = '\0';
 	}
 
-	fclose(fp);
+	if (fclose(fp) != 0)
+	{
+		result = -1;
+	}
+
+	return result;
+}
+
+void text_commit_to_file(todo_text_t* t, const char* path)
+{
+	if (text_write_to_file(t, path, "w") != 0)
+	{
+		fprintf(stderr, "ERROR: Failed to write file (%s)\n", path);
+		exit(-1);
+	}
 }
 
+// Completing a line completes its subtasks, removing a completed line removes them
+// A completed line with open subtasks, e.g. indented under it later, gets them completed instead of removed
+// Plain lines have no completion status and are left alone
 // Returns 1 if redraw is needed, 0 if toggle, -1 if nothing
 int text_set_completion(todo_text_t* text)
 {
-	if (text->size != 0)
+	if (text->size == 0 || !text_is_item(text->data[text->selected]))
+	{
+		return -1; // NOTHING
+	}
+
+	size_t end = text->selected + text->subtree[text->selected];
+	bool open = false;
+	for (size_t i = text->selected; i < end && !open; ++i)
+	{
+		open = text_is_item(text->data[i]) && !text_line_completed(text->data[i]);
+	}
+
+	if (open)
 	{
-		if (text->data[text->selected][1] == ' ')
+		for (size_t i = text->selected; i < end; ++i)
+		{
+			if (text_is_item(text->data[i]))
+			{
+				text_marker(text->data[i])[1] = 'X';
+			}
+		}
+		text->version++;
+
+		if (end - text->selected == 1 || text->collapsed[text->selected])
 		{
-			text->data[text->selected][1] = 'X';
 			return 0; // TOGGLE
 		}
-		else
+		return 1; // REDRAW
+	}
+
+	// The next line takes over the row, unless the removed subtree was the last
+	text_remove(text, text->selected);
+	if (text->selected == text->size)
+	{
+		text_select_last(text);
+	}
+	return 1; // REDRAW
+}
+
+// Called for every line of a streamed file, line has no trailing newline
+// Called once more with line == NULL after the last line
+// Returns 0 to drop the line, 1 to keep it, -1 to abort the rewrite
+typedef int (*text_stream_filter_t)(char* line, size_t index, void* data);
+
+// Rewrites path one line at a time through filter, without loading the whole file
+// Writes to a unique temporary file next to the target of path, which replaces it once filter accepted every line
+// Symlinks are followed, so the link itself stays, and the mode and owner of the file are kept
+int text_stream_rewrite(const char* path, text_stream_filter_t filter, void* data)
+{
+	char* real_path = realpath(path, NULL);
+	FILE* in = real_path ? fopen(real_path, "r") : NULL;
+	struct stat st;
+	if (in == NULL || fstat(fileno(in), &st) != 0)
+	{
+		if (in)
+			fclose(in);
+		free(real_path);
+		fprintf(stderr, "ERROR: Failed to open file (%s)\n", path);
+		return -1;
+	}
+
+	size_t tmp_length = strlen(real_path) + 8;
+	char tmp_path[tmp_length];
+	snprintf(tmp_path, tmp_length, "%s.XXXXXX", real_path);
+
+	int fd = mkstemp(tmp_path);
+	FILE* out = fd == -1 ? NULL : fdopen(fd, "w");
+	if (out == NULL)
+	{
+		if (fd != -1)
+		{
+			close(fd);
+			remove(tmp_path);
+		}
+		fclose(in);
+		free(real_path);
+		fprintf(stderr, "ERROR: Failed to create temporary file for (%s)\n", path);
+		return -1;
+	}
+
+	// Only root may give files away, anyone else ends up owning the rewritten file
+	int result = 0;
+	if (fchmod(fd, st.st_mode & 07777) != 0 || (fchown(fd, st.st_uid, st.st_gid) != 0 && errno != EPERM))
+	{
+		fprintf(stderr, "ERROR: Failed to keep mode and owner of file (%s)\n", path);
+		result = -1;
+	}
+
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t read;
+	size_t index = 0;
+	while (result == 0 && (read = getline(&line, &len, in)) != -1)
+	{
+		if (read > 0 && line[read-1] == '\n')
 		{
-			text_remove(text, text->selected);
-			if (text->selected == text->size)
+			line[--read] = '\0';
+		}
+
+		int keep = filter(line, index++, data);
+		if (keep == -1)
+		{
+			result = -1;
+			break;
+		}
+
+		if (keep)
+		{
+			line[read] = '\n';
+			if (fwrite(line, sizeof(char), read+1, out) != (size_t) read+1)
 			{
-				text->selected--;
+				fprintf(stderr, "ERROR: Failed to write file (%s)\n", path);
+				result = -1;
 			}
-			return 1; // REDRAW
 		}
 	}
 
-	return -1; // NOTHING
+	// getline returns -1 on errors too, which mustn't pass for the end of the file
+	if (result == 0 && ferror(in))
+	{
+		fprintf(stderr, "ERROR: Failed to read file (%s)\n", path);
+		result = -1;
+	}
+
+	// Let the filter know the file ended, e.g. to check for missing lines
+	if (result == 0 && filter(NULL, index, data) == -1)
+	{
+		result = -1;
+	}
+
+	free(line);
+	fclose(in);
+
+	// fclose doesn't report every write error, e.g. a full disk, so the data has to reach the disk before rename
+	if (result == 0 && (fflush(out) != 0 || ferror(out) || fsync(fd) != 0))
+	{
+		fprintf(stderr, "ERROR: Failed to write file (%s)\n", path);
+		result = -1;
+	}
+
+	if (fclose(out) != 0 && result == 0)
+	{
+		fprintf(stderr, "ERROR: Failed to write file (%s)\n", path);
+		result = -1;
+	}
+
+	if (result == -1)
+	{
+		remove(tmp_path);
+		free(real_path);
+		return -1;
+	}
+
+	if (rename(tmp_path, real_path) != 0)
+	{
+		remove(tmp_path);
+		free(real_path);
+		fprintf(stderr, "ERROR: Failed to replace file (%s)\n", path);
+		return -1;
+	}
+
+	free(real_path);
+	return 0;
 }
 
 int text_last_empty(todo_text_t* text)